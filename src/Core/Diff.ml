@@ -33,160 +33,252 @@
 
 (* Parts of Code of GNU diff (analyze.c) translated from C to OCaml
    and adjusted. Basic algorithm described by Eugene W.Myers in:
-     "An O(ND) Difference Algorithm and Its Variations" *)
+     "An O(ND) Difference Algorithm and Its Variations"
 
-     exception DiagReturn of int;;
-     
-     let diag fd bd sh xv yv xoff xlim yoff ylim =
-       let dmin = xoff - ylim in
-       let dmax = xlim - yoff in
-       let fmid = xoff - yoff in
-       let bmid = xlim - ylim in
-       let odd = (fmid - bmid) land 1 <> 0 in
-       fd.(sh+fmid) <- xoff;
-       bd.(sh+bmid) <- xlim;
-       try
-         let rec loop fmin fmax bmin bmax =
-           let fmin =
-             if fmin > dmin then begin fd.(sh+fmin-2) <- -1; fmin - 1 end
-             else fmin + 1
-           in
-           let fmax =
-             if fmax < dmax then begin fd.(sh+fmax+2) <- -1; fmax + 1 end
-             else fmax - 1
-           in
-           begin let rec loop d =
-             if d < fmin then ()
-             else
-               let tlo = fd.(sh+d-1) in
-               let thi = fd.(sh+d+1) in
-               let x = if tlo >= thi then tlo + 1 else thi in
-               let x =
-                 let rec loop xv yv xlim ylim x y =
-                   if x < xlim && y < ylim && xv x == yv y then
-                     loop xv yv xlim ylim (x + 1) (y + 1)
-                   else x
-                 in
-                 loop xv yv xlim ylim x (x - d)
-               in
-               fd.(sh+d) <- x;
-               if odd && bmin <= d && d <= bmax && bd.(sh+d) <= fd.(sh+d) then
-                 raise (DiagReturn d)
-               else loop (d - 2)
-           in
-             loop fmax
-           end;
-           let bmin =
-             if bmin > dmin then begin bd.(sh+bmin-2) <- max_int; bmin - 1 end
-             else bmin + 1
-           in
-           let bmax =
-             if bmax < dmax then begin bd.(sh+bmax+2) <- max_int; bmax + 1 end
-             else bmax - 1
-           in
-           begin let rec loop d =
-             if d < bmin then ()
-             else
-               let tlo = bd.(sh+d-1) in
-               let thi = bd.(sh+d+1) in
-               let x = if tlo < thi then tlo else thi - 1 in
-               let x =
-                 let rec loop xv yv xoff yoff x y =
-                   if x > xoff && y > yoff && xv (x - 1) == yv (y - 1) then
-                     loop xv yv xoff yoff (x - 1) (y - 1)
-                   else x
-                 in
-                 loop xv yv xoff yoff x (x - d)
-               in
-               bd.(sh+d) <- x;
-               if not odd && fmin <= d && d <= fmax && bd.(sh+d) <= fd.(sh+d) then
-                 raise (DiagReturn d)
-               else loop (d - 2)
-           in
-             loop bmax
-           end;
-           loop fmin fmax bmin bmax
-         in
-         loop fmid fmid bmid bmid
-       with DiagReturn i -> i
-     ;;
-     
-     let diff_loop a ai b bi n m =
-       let fd = Array.make (n + m + 3) 0 in
-       let bd = Array.make (n + m + 3) 0 in
-       let sh = m + 1 in
-       let xvec i = a.(ai.(i)) in
-       let yvec j = b.(bi.(j)) in
-       let chng1 = Array.make (Array.length a) true in
-       let chng2 = Array.make (Array.length b) true in
-       for i = 0 to n - 1 do chng1.(ai.(i)) <- false done;
-       for j = 0 to m - 1 do chng2.(bi.(j)) <- false done;
-       let rec loop xoff xlim yoff ylim =
-         let (xoff, yoff) =
-           let rec loop xoff yoff =
-             if xoff < xlim && yoff < ylim && xvec xoff == yvec yoff then
-               loop (xoff + 1) (yoff + 1)
-             else xoff, yoff
-           in
-           loop xoff yoff
-         in
-         let (xlim, ylim) =
-           let rec loop xlim ylim =
-             if xlim > xoff && ylim > yoff && xvec (xlim - 1) == yvec (ylim - 1)
-             then
-               loop (xlim - 1) (ylim - 1)
-             else xlim, ylim
-           in
-           loop xlim ylim
-         in
-         if xoff = xlim then
-           for y = yoff to ylim - 1 do chng2.(bi.(y)) <- true done
-         else if yoff = ylim then
-           for x = xoff to xlim - 1 do chng1.(ai.(x)) <- true done
-         else
-           let d = diag fd bd sh xvec yvec xoff xlim yoff ylim in
-           let b = bd.(sh+d) in loop xoff b yoff (b - d); loop b xlim (b - d) ylim
-       in
-       loop 0 n 0 m; chng1, chng2
-     ;;
-     
-     (* [make_indexer a b] returns an array of index of items of [a] which
-        are also present in [b]; this way, the main algorithm can skip items
-        which, anyway, are different. This improves the speed much.
-          The same time, this function updates the items of so that all
-        equal items point to the same unique item. All items comparisons in
-        the main algorithm can therefore be done with [==] instead of [=],
-        what can improve speed much. *)
-     let make_indexer a b =
-       let n = Array.length a in
-       let htb = Hashtbl.create (10 * Array.length b) in
-       Array.iteri
-         (fun i e ->
-            try b.(i) <- Hashtbl.find htb e with Not_found -> Hashtbl.add htb e e)
-         b;
-       let ai = Array.make n 0 in
-       let k =
-         let rec loop i k =
-           if i = n then k
-           else
-             let k =
-               try
-                 a.(i) <- Hashtbl.find htb a.(i);
-                 (* line found (since "Not_found" not raised) *)
-                 ai.(k) <- i;
-                 k + 1
-               with Not_found -> k
-             in
-             loop (i + 1) k
-         in
-         loop 0 0
-       in
-       Array.sub ai 0 k
-     ;;
-     
-     let f a b =
-       let ai = make_indexer a b in
-       let bi = make_indexer b a in
-       let n = Array.length ai in
-       let m = Array.length bi in diff_loop a ai b bi n m
-     ;;
\ No newline at end of file
+   Lines are hashed to integer ids up front, so every comparison in the
+   algorithm is an integer comparison. Before running Myers on a range, the
+   range is split on lines that are unique on both sides (the "patience"
+   heuristic), which keeps the edit distance that Myers sees small for
+   typical source edits. The Myers search is bounded by a budget - if it
+   runs out, the remaining range is reported as entirely changed, rather
+   than stalling the caller. *)
+
+exception DiagReturn of int
+exception BudgetExceeded
+
+let default_budget = 4_000_000
+
+let diag budget fd bd sh xv yv xoff xlim yoff ylim =
+  let dmin = xoff - ylim in
+  let dmax = xlim - yoff in
+  let fmid = xoff - yoff in
+  let bmid = xlim - ylim in
+  let odd = (fmid - bmid) land 1 <> 0 in
+  fd.(sh+fmid) <- xoff;
+  bd.(sh+bmid) <- xlim;
+  try
+    let rec loop fmin fmax bmin bmax =
+      budget := !budget - (fmax - fmin) - (bmax - bmin) - 2;
+      if !budget < 0 then raise BudgetExceeded;
+      let fmin =
+        if fmin > dmin then begin fd.(sh+fmin-2) <- -1; fmin - 1 end
+        else fmin + 1
+      in
+      let fmax =
+        if fmax < dmax then begin fd.(sh+fmax+2) <- -1; fmax + 1 end
+        else fmax - 1
+      in
+      begin let rec loop d =
+        if d < fmin then ()
+        else
+          let tlo = fd.(sh+d-1) in
+          let thi = fd.(sh+d+1) in
+          let x = if tlo >= thi then tlo + 1 else thi in
+          let x =
+            let rec loop x y =
+              if x < xlim && y < ylim && xv.(x) = yv.(y) then
+                loop (x + 1) (y + 1)
+              else x
+            in
+            loop x (x - d)
+          in
+          fd.(sh+d) <- x;
+          if odd && bmin <= d && d <= bmax && bd.(sh+d) <= fd.(sh+d) then
+            raise (DiagReturn d)
+          else loop (d - 2)
+      in
+        loop fmax
+      end;
+      let bmin =
+        if bmin > dmin then begin bd.(sh+bmin-2) <- max_int; bmin - 1 end
+        else bmin + 1
+      in
+      let bmax =
+        if bmax < dmax then begin bd.(sh+bmax+2) <- max_int; bmax + 1 end
+        else bmax - 1
+      in
+      begin let rec loop d =
+        if d < bmin then ()
+        else
+          let tlo = bd.(sh+d-1) in
+          let thi = bd.(sh+d+1) in
+          let x = if tlo < thi then tlo else thi - 1 in
+          let x =
+            let rec loop x y =
+              if x > xoff && y > yoff && xv.(x - 1) = yv.(y - 1) then
+                loop (x - 1) (y - 1)
+              else x
+            in
+            loop x (x - d)
+          in
+          bd.(sh+d) <- x;
+          if not odd && fmin <= d && d <= fmax && bd.(sh+d) <= fd.(sh+d) then
+            raise (DiagReturn d)
+          else loop (d - 2)
+      in
+        loop bmax
+      end;
+      loop fmin fmax bmin bmax
+    in
+    loop fmid fmid bmid bmid
+  with DiagReturn i -> i
+
+(* The state shared by a single diff: the hashed (and filtered) sequences,
+   the change flags for them, and the Myers scratch vectors. *)
+type context = {
+  xv : int array;
+  yv : int array;
+  chng1 : bool array;
+  chng2 : bool array;
+  fd : int array;
+  bd : int array;
+  sh : int;
+  budget : int ref;
+}
+
+let mark_changed chng off lim =
+  for i = off to lim - 1 do chng.(i) <- true done
+
+let rec myers ctx xoff xlim yoff ylim =
+  let { xv; yv; _ } = ctx in
+  let rec trim_start xoff yoff =
+    if xoff < xlim && yoff < ylim && xv.(xoff) = yv.(yoff) then
+      trim_start (xoff + 1) (yoff + 1)
+    else xoff, yoff
+  in
+  let (xoff, yoff) = trim_start xoff yoff in
+  let rec trim_end xlim ylim =
+    if xlim > xoff && ylim > yoff && xv.(xlim - 1) = yv.(ylim - 1) then
+      trim_end (xlim - 1) (ylim - 1)
+    else xlim, ylim
+  in
+  let (xlim, ylim) = trim_end xlim ylim in
+  if xoff = xlim then mark_changed ctx.chng2 yoff ylim
+  else if yoff = ylim then mark_changed ctx.chng1 xoff xlim
+  else
+    let d = diag ctx.budget ctx.fd ctx.bd ctx.sh xv yv xoff xlim yoff ylim in
+    let b = ctx.bd.(ctx.sh+d) in
+    myers ctx xoff b yoff (b - d);
+    myers ctx b xlim (b - d) ylim
+
+(* [unique_anchors ctx xoff xlim yoff ylim] returns the pairs of positions
+   of lines that occur exactly once in both ranges, restricted to the
+   longest chain that is increasing on both sides. *)
+let unique_anchors ctx xoff xlim yoff ylim =
+  (* id -> (count in x, position in x, count in y, position in y) *)
+  let counts = Hashtbl.create (xlim - xoff) in
+  for x = xoff to xlim - 1 do
+    match Hashtbl.find_opt counts ctx.xv.(x) with
+    | None -> Hashtbl.replace counts ctx.xv.(x) (1, x, 0, 0)
+    | Some (cx, px, cy, py) ->
+      Hashtbl.replace counts ctx.xv.(x) (cx + 1, px, cy, py)
+  done;
+  for y = yoff to ylim - 1 do
+    match Hashtbl.find_opt counts ctx.yv.(y) with
+    | None -> ()
+    | Some (cx, px, cy, _) ->
+      Hashtbl.replace counts ctx.yv.(y) (cx, px, cy + 1, y)
+  done;
+  let pairs =
+    Hashtbl.fold
+      (fun _ (cx, px, cy, py) acc ->
+         if cx = 1 && cy = 1 then (px, py) :: acc else acc)
+      counts []
+    |> Array.of_list
+  in
+  Array.sort compare pairs;
+  (* Patience sorting: longest increasing subsequence on the y positions *)
+  let n = Array.length pairs in
+  if n = 0 then []
+  else begin
+    let tails = Array.make n 0 in
+    let prev = Array.make n (-1) in
+    let len = ref 0 in
+    for i = 0 to n - 1 do
+      let (_, py) = pairs.(i) in
+      let lo = ref 0 and hi = ref !len in
+      while !lo < !hi do
+        let mid = (!lo + !hi) / 2 in
+        if snd pairs.(tails.(mid)) < py then lo := mid + 1 else hi := mid
+      done;
+      if !lo > 0 then prev.(i) <- tails.(!lo - 1);
+      tails.(!lo) <- i;
+      if !lo = !len then incr len
+    done;
+    let rec collect i acc =
+      if i < 0 then acc else collect prev.(i) (pairs.(i) :: acc)
+    in
+    collect tails.(!len - 1) []
+  end
+
+let rec patience ctx xoff xlim yoff ylim =
+  if xoff = xlim then mark_changed ctx.chng2 yoff ylim
+  else if yoff = ylim then mark_changed ctx.chng1 xoff xlim
+  else
+    match unique_anchors ctx xoff xlim yoff ylim with
+    | [] ->
+      (try myers ctx xoff xlim yoff ylim with
+       | BudgetExceeded ->
+         mark_changed ctx.chng1 xoff xlim;
+         mark_changed ctx.chng2 yoff ylim)
+    | anchors ->
+      let (x, y) =
+        List.fold_left
+          (fun (x, y) (ax, ay) ->
+             patience ctx x ax y ay;
+             (ax + 1, ay + 1))
+          (xoff, yoff) anchors
+      in
+      patience ctx x xlim y ylim
+
+(* [hash a b] maps every line to an integer id, equal lines sharing an id.
+   Lines that don't occur on the other side are dropped, since they are
+   changed anyway - the returned index arrays map back to the inputs. *)
+let hash a b =
+  let ids = Hashtbl.create (Array.length a + Array.length b) in
+  let id_of e =
+    match Hashtbl.find_opt ids e with
+    | Some id -> id
+    | None ->
+      let id = Hashtbl.length ids in
+      Hashtbl.add ids e id;
+      id
+  in
+  let a_ids = Array.map id_of a in
+  let b_ids = Array.map id_of b in
+  let count = Hashtbl.length ids in
+  let in_a = Array.make count false in
+  let in_b = Array.make count false in
+  Array.iter (fun id -> in_a.(id) <- true) a_ids;
+  Array.iter (fun id -> in_b.(id) <- true) b_ids;
+  let filter seq present =
+    let idx = ref [] in
+    Array.iteri (fun i id -> if present.(id) then idx := i :: !idx) seq;
+    let indices = Array.of_list (List.rev !idx) in
+    (indices, Array.map (fun i -> seq.(i)) indices)
+  in
+  let (ai, xv) = filter a_ids in_b in
+  let (bi, yv) = filter b_ids in_a in
+  (ai, xv, bi, yv)
+
+let f ?(budget = default_budget) a b =
+  let (ai, xv, bi, yv) = hash a b in
+  let n = Array.length xv in
+  let m = Array.length yv in
+  let ctx = {
+    xv;
+    yv;
+    chng1 = Array.make n false;
+    chng2 = Array.make m false;
+    fd = Array.make (n + m + 3) 0;
+    bd = Array.make (n + m + 3) 0;
+    sh = m + 1;
+    budget = ref budget;
+  } in
+  patience ctx 0 n 0 m;
+  (* Lines that were filtered out have no counterpart, so are changed *)
+  let d1 = Array.make (Array.length a) true in
+  let d2 = Array.make (Array.length b) true in
+  Array.iteri (fun k i -> d1.(i) <- ctx.chng1.(k)) ai;
+  Array.iteri (fun k j -> d2.(j) <- ctx.chng2.(k)) bi;
+  d1, d2
@@ -33,7 +33,7 @@
 
 (** Differences between two arrays. *)
 
-val f : 'a array -> 'a array -> bool array * bool array;;
+val f : ?budget:int -> 'a array -> 'a array -> bool array * bool array;;
 (** [Diff.f a1 a2] returns a couple of two arrays of booleans [(d1, d2)].
       [d1] has the same size as [a1].
       [d2] has the same size as [a2].
@@ -44,4 +44,8 @@ val f : 'a array -> 'a array -> bool array * bool array;;
     the input arrays being the array of lines of each file.
     Can be used also to compare two strings (they must have been exploded
     into arrays of chars), or two DNA strings, and so on.
+
+    [budget] bounds the work done by the Myers search. If it is exhausted,
+    the remaining unmatched lines are reported as changed - the result is
+    still a valid (if not minimal) diff.
 *)
\ No newline at end of file
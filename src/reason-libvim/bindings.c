@@ -1326,6 +1326,36 @@ CAMLprim value libvim_vimBufferGetLine(value vBuf, value vLine) {
   CAMLreturn(ret);
 }
 
+// Returns the lines [start, end) (one-based) as an array, in a single call
+CAMLprim value libvim_vimBufferGetLines(value vBuf, value vStart,
+                                        value vEnd) {
+  CAMLparam3(vBuf, vStart, vEnd);
+  CAMLlocal2(ret, line);
+  buf_T *buf = (buf_T *)vBuf;
+  int start = Int_val(vStart);
+  int end = Int_val(vEnd);
+  int lineCount = vimBufferGetLineCount(buf);
+
+  if (start < 1) {
+    start = 1;
+  }
+
+  if (end > lineCount + 1) {
+    end = lineCount + 1;
+  }
+
+  int count = end > start ? end - start : 0;
+  ret = caml_alloc(count, 0);
+
+  for (int i = 0; i < count; i++) {
+    char_u *c = vimBufferGetLine(buf, start + i);
+    line = caml_copy_string((const char *)c);
+    Store_field(ret, i, line);
+  }
+
+  CAMLreturn(ret);
+}
+
 CAMLprim value libvim_vimBufferSetLines(value vBuf, value vStart, value vEnd,
                                         value vLines) {
   CAMLparam4(vBuf, vStart, vEnd, vLines);
@@ -6,6 +6,7 @@
 #include <caml/mlvalues.h>
 #include <caml/threads.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <oniguruma.h>
 
@@ -66,7 +67,7 @@ CAMLprim value reonig_create(value vPattern) {
 
   const char *pattern = String_val(vPattern);
   int status =
-      onig_new(&reg, (UChar *)pattern, (UChar *)(pattern + strlen(pattern)),
+      onig_new(&reg, (UChar *)pattern, (UChar *)(pattern + caml_string_length(vPattern)),
                ONIG_OPTION_CAPTURE_GROUP, ONIG_ENCODING_UTF8,
                ONIG_SYNTAX_DEFAULT, &einfo);
 
@@ -92,45 +93,114 @@ CAMLprim value reonig_create(value vPattern) {
 
 CAMLprim value reonig_end() { onig_end(); return Val_unit; };
 
-CAMLprim value reonig_search(value vStr, value vPos, value vRegExp) {
-  CAMLparam3(vStr, vPos, vRegExp);
+/* Runs a search over the whole of vStr, using the OCaml string length
+   rather than strlen - so embedded NULs are handled, and we never have to
+   walk the line just to find where it ends. Only match starts in
+   [position, limit] are considered, which lets the caller bound the
+   window Oniguruma scans. */
+static int reonig_search_region(regex_t *regexp, OnigRegion *region,
+                                value vStr, size_t position, size_t limit) {
+  UChar *searchData = (UChar *)String_val(vStr);
+  size_t end = caml_string_length(vStr);
+
+  if (limit > end) {
+    limit = end;
+  }
+
+  // onig_search treats range < start as a backward search, so bail out here
+  if (position > limit) {
+    return ONIG_MISMATCH;
+  }
+
+  return onig_search(regexp, searchData, searchData + end,
+                     searchData + position, searchData + limit, region,
+                     ONIG_OPTION_NONE);
+}
+
+static int reonig_search_internal(regexp_W *p, value vStr, size_t position,
+                                  size_t limit) {
+  p->status =
+      reonig_search_region(p->regexp, p->region, vStr, position, limit);
+  return p->status;
+}
+
+static value reonig_val_matches(value vStr, OnigRegion *region) {
+  CAMLparam1(vStr);
   CAMLlocal2(ret, v);
 
-  UChar *searchData = (UChar *) String_val(vStr);
-  size_t position = Int_val(vPos);
-  size_t end = strlen((const char *) searchData);
+  int num = region->num_regs;
+  if (num == 0) {
+    CAMLreturn(Atom(0));
+  }
+
+  ret = caml_alloc(num, 0);
+  for (int i = 0; i < num; i++) {
+    v = caml_alloc(5, 0);
+    int start = *(region->beg + i);
+    if (start < 0) {
+      start = 0;
+    }
+
+    int length = *(region->end + i) - *(region->beg + i);
+    if (length < 0) {
+      length = 0;
+    }
+
+    Store_field(v, 0, Val_int(i));
+    Store_field(v, 1, Val_int(start));
+    Store_field(v, 2, Val_int(length));
+    Store_field(v, 3, Val_int(start + length));
+    Store_field(v, 4, vStr);
+
+    Store_field(ret, i, v);
+  };
+
+  CAMLreturn(ret);
+}
+
+/* Writes the region into a caller-owned int32 bigarray, laid out as
+   [| count, start0, end0, start1, end1, ... |]. The count is always the
+   real number of groups, even if the bigarray only has room for some of
+   them - so the caller can tell it needs to grow. */
+static int reonig_write_regions(OnigRegion *region, value vRegions) {
+  int32_t *data = (int32_t *)Caml_ba_data_val(vRegions);
+  intnat capacity = (Caml_ba_array_val(vRegions)->dim[0] - 1) / 2;
+  int num = region->num_regs;
+
+  data[0] = num;
+  for (int i = 0; i < num && i < capacity; i++) {
+    int start = *(region->beg + i);
+    if (start < 0) {
+      start = 0;
+    }
+
+    int length = *(region->end + i) - *(region->beg + i);
+    if (length < 0) {
+      length = 0;
+    }
+
+    data[1 + 2 * i] = start;
+    data[2 + 2 * i] = start + length;
+  }
+
+  return num;
+}
+
+static void reonig_clear_regions(value vRegions) {
+  int32_t *data = (int32_t *)Caml_ba_data_val(vRegions);
+  data[0] = 0;
+}
+
+CAMLprim value reonig_search(value vStr, value vPos, value vRegExp) {
+  CAMLparam3(vStr, vPos, vRegExp);
+  CAMLlocal1(ret);
 
   regexp_W *p = Data_custom_val(vRegExp);
-  regex_t *regex = p->regexp;
-  OnigRegion *region = p->region;
-  int status =
-      onig_search(regex, searchData, searchData + end, searchData + position,
-                  searchData + end, region, ONIG_OPTION_NONE);
+  int status = reonig_search_internal(p, vStr, Int_val(vPos),
+                                      caml_string_length(vStr));
 
-  p->status = status;
   if (status != ONIG_MISMATCH) {
-    int num = region->num_regs;
-    ret = caml_alloc(num, 0);
-    for (int i = 0; i < num; i++) {
-      v = caml_alloc(5, 0);
-      int start = *(region->beg + i);
-      if (start < 0) {
-        start = 0;
-      }
-
-      int length = *(region->end + i) - *(region->beg + i);
-      if (length < 0) {
-        length = 0;
-      }
-
-      Store_field(v, 0, Val_int(i));
-      Store_field(v, 1, Val_int(start));
-      Store_field(v, 2, Val_int(length));
-      Store_field(v, 3, Val_int(start + length));
-      Store_field(v, 4, vStr);
-
-      Store_field(ret, i, v);
-    };
+    ret = reonig_val_matches(vStr, p->region);
   } else {
     ret = Atom(0);
   }
@@ -140,35 +210,68 @@ CAMLprim value reonig_search(value vStr, value vPos, value vRegExp) {
 
 CAMLprim value reonig_get_last_matches(value vStr, value vRegExp) {
   CAMLparam2(vStr, vRegExp);
-  CAMLlocal2(ret, v);
+  CAMLlocal1(ret);
+  regexp_W *p = Data_custom_val(vRegExp);
+
+  if (p->status != ONIG_MISMATCH) {
+    ret = reonig_val_matches(vStr, p->region);
+  } else {
+    ret = Atom(0);
+  }
+
+  CAMLreturn(ret);
+};
+
+CAMLprim value reonig_get_last_regions(value vRegExp, value vRegions) {
+  CAMLparam2(vRegExp, vRegions);
+  regexp_W *p = Data_custom_val(vRegExp);
+
+  if (p->status != ONIG_MISMATCH) {
+    CAMLreturn(Val_int(reonig_write_regions(p->region, vRegions)));
+  } else {
+    reonig_clear_regions(vRegions);
+    CAMLreturn(Val_int(0));
+  }
+};
+
+/* Like reonig_search, but runs onig_search outside the OCaml runtime lock,
+   so other OCaml threads can run in the meantime. The string is copied,
+   since it may be moved by the GC while we don't hold the lock - so this
+   is only worth it for long subjects. The regexp must not be used from
+   another thread while the search is running. */
+CAMLprim value reonig_search_concurrent(value vStr, value vPos,
+                                        value vRegExp) {
+  CAMLparam3(vStr, vPos, vRegExp);
+  CAMLlocal1(ret);
+
   regexp_W *p = Data_custom_val(vRegExp);
   regex_t *regex = p->regexp;
-  int status = p->status;
   OnigRegion *region = p->region;
 
+  size_t len = caml_string_length(vStr);
+  intnat position = Long_val(vPos);
+  if (position < 0 || (size_t)position > len) {
+    p->status = ONIG_MISMATCH;
+    CAMLreturn(Atom(0));
+  }
+
+  UChar *searchData = malloc(len + 1);
+  memcpy(searchData, String_val(vStr), len);
+  searchData[len] = 0;
+
+  caml_release_runtime_system();
+  int status = onig_search(regex, searchData, searchData + len,
+                           searchData + position, searchData + len, region,
+                           ONIG_OPTION_NONE);
+  caml_acquire_runtime_system();
+
+  free(searchData);
+
+  // The custom block may have moved while we didn't hold the lock
+  p = Data_custom_val(vRegExp);
+  p->status = status;
   if (status != ONIG_MISMATCH) {
-    int num = region->num_regs;
-    ret = caml_alloc(num, 0);
-    for (int i = 0; i < num; i++) {
-      v = caml_alloc(5, 0);
-      int start = *(region->beg + i);
-      if (start < 0) {
-        start = 0;
-      }
-
-      int length = *(region->end + i) - *(region->beg + i);
-      if (length < 0) {
-        length = 0;
-      }
-
-      Store_field(v, 0, Val_int(i));
-      Store_field(v, 1, Val_int(start));
-      Store_field(v, 2, Val_int(length));
-      Store_field(v, 3, Val_int(start + length));
-      Store_field(v, 4, vStr);
-
-      Store_field(ret, i, v);
-    }
+    ret = reonig_val_matches(vStr, region);
   } else {
     ret = Atom(0);
   }
@@ -176,33 +279,206 @@ CAMLprim value reonig_get_last_matches(value vStr, value vRegExp) {
   CAMLreturn(ret);
 };
 
+static int reonig_region_match_start(int status, OnigRegion *region) {
+  if (status != ONIG_MISMATCH && region->num_regs >= 1) {
+    int start = *(region->beg);
+    return start < 0 ? 0 : start;
+  } else {
+    return -1;
+  }
+}
+
+static value reonig_val_match_start(regexp_W *p) {
+  return Val_int(reonig_region_match_start(p->status, p->region));
+}
+
 CAMLprim value reonig_search_fast(value vStr, value vPos, value vRegExp) {
   CAMLparam3(vStr, vPos, vRegExp);
 
-  UChar *searchData = (UChar *) String_val(vStr);
-  size_t position = Int_val(vPos);
-  size_t end = strlen((const char *) searchData);
+  regexp_W *p = Data_custom_val(vRegExp);
+  reonig_search_internal(p, vStr, Int_val(vPos), caml_string_length(vStr));
+
+  CAMLreturn(reonig_val_match_start(p));
+};
+
+CAMLprim value reonig_search_range(value vStr, value vPos, value vLimit,
+                                   value vRegExp) {
+  CAMLparam4(vStr, vPos, vLimit, vRegExp);
 
   regexp_W *p = Data_custom_val(vRegExp);
-  regex_t *regex = p->regexp;
-  OnigRegion *region = p->region;
-  int status =
-      onig_search(regex, searchData, searchData + end, searchData + position,
-                  searchData + end, region, ONIG_OPTION_NONE);
+  int limit = Int_val(vLimit);
+  if (limit < 0) {
+    p->status = ONIG_MISMATCH;
+    CAMLreturn(Val_int(-1));
+  }
+  reonig_search_internal(p, vStr, Int_val(vPos), limit);
 
-  p->status = status;
-  if (status != ONIG_MISMATCH) {
-    int num = region->num_regs;
-    if (num >= 1) {
-      int start = *(region->beg);
-      if (start < 0) {
-        start = 0;
-      }
-      CAMLreturn(Val_int(start));
+  CAMLreturn(reonig_val_match_start(p));
+};
+
+/* OnigScanner - evaluates a whole set of regexps in a single call, like
+   vscode-oniguruma's scanner. The regexps themselves live on the OCaml side
+   (custom blocks can move), so they are passed in on every search - the
+   native part holds the per-regexp result cache.
+
+   Each slot searches into its own region, rather than the one owned by the
+   regexp: the same OnigRegExp.t is also used for single-regexp searches,
+   which cache their last result on the OCaml side, and writing to its region
+   here would silently change what that cache reports. */
+typedef struct _scanner {
+  int count;
+  // Region holding the match behind cachedStart, per slot
+  OnigRegion **regions;
+  // Start of the first match found searching from cachedFrom, or -1
+  int *cachedStart;
+  // Position the cached search started at, or -1 if not evaluated
+  int *cachedFrom;
+  // Last position a cached match was allowed to start at
+  int *cachedLimit;
+} scanner_W;
+
+void reonig_finalize_scanner(value v) {
+  scanner_W *p = (scanner_W *)Data_custom_val(v);
+  for (int i = 0; i < p->count; i++) {
+    onig_region_free(p->regions[i], 1);
+  }
+  free(p->regions);
+  free(p->cachedStart);
+  free(p->cachedFrom);
+  free(p->cachedLimit);
+};
+
+static struct custom_operations scanner_custom_ops = {
+  .identifier = "scanner handling",
+  .finalize = reonig_finalize_scanner,
+  .compare = custom_compare_default,
+  .hash = custom_hash_default,
+  .serialize = custom_serialize_default,
+  .deserialize = custom_deserialize_default
+};
+
+static void reonig_scanner_reset(scanner_W *p) {
+  for (int i = 0; i < p->count; i++) {
+    p->cachedStart[i] = -1;
+    p->cachedFrom[i] = -1;
+    p->cachedLimit[i] = -1;
+  }
+}
+
+CAMLprim value reonig_scanner_create(value vCount) {
+  CAMLparam1(vCount);
+  CAMLlocal1(v);
+
+  scanner_W scannerWrapper;
+  int count = Int_val(vCount);
+  // Always allocate at least one slot, so an empty scanner is still valid
+  size_t slots = count > 0 ? count : 1;
+  scannerWrapper.count = count;
+  scannerWrapper.regions = malloc(sizeof(OnigRegion *) * slots);
+  for (int i = 0; i < count; i++) {
+    scannerWrapper.regions[i] = onig_region_new();
+  }
+  scannerWrapper.cachedStart = malloc(sizeof(int) * slots);
+  scannerWrapper.cachedFrom = malloc(sizeof(int) * slots);
+  scannerWrapper.cachedLimit = malloc(sizeof(int) * slots);
+  reonig_scanner_reset(&scannerWrapper);
+
+  v = caml_alloc_custom(&scanner_custom_ops, sizeof(scanner_W), 0, 1);
+  memcpy(Data_custom_val(v), &scannerWrapper, sizeof(scanner_W));
+  CAMLreturn(v);
+}
+
+/* Finds the regexp with the earliest match at or after position - ties go
+   to the lowest index. Returns its index, or -1 if nothing matched. On a
+   match, the region of that slot holds the match. */
+static int reonig_scanner_search_internal(scanner_W *scanner, value vRegExps,
+                                          value vStr, int position,
+                                          int isSameString) {
+  int len = caml_string_length(vStr);
+
+  if (!isSameString) {
+    reonig_scanner_reset(scanner);
+  }
+
+  int best = -1;
+  int bestStart = -1;
+
+  for (int i = 0; i < scanner->count && bestStart != position; i++) {
+    // Once we have a candidate, only an earlier match can beat it
+    int limit = best >= 0 ? bestStart - 1 : len;
+    int start;
+
+    if (scanner->cachedFrom[i] >= 0 && scanner->cachedFrom[i] <= position &&
+        (scanner->cachedStart[i] >= position ||
+         (scanner->cachedStart[i] == -1 && scanner->cachedLimit[i] >= limit))) {
+      start = scanner->cachedStart[i];
     } else {
-      CAMLreturn(Val_int(-1));
+      regexp_W *p = Data_custom_val(Field(vRegExps, i));
+      OnigRegion *region = scanner->regions[i];
+      int status =
+          reonig_search_region(p->regexp, region, vStr, position, limit);
+      start = reonig_region_match_start(status, region);
+      scanner->cachedStart[i] = start;
+      scanner->cachedFrom[i] = position;
+      scanner->cachedLimit[i] = limit;
+    }
+
+    if (start >= 0 && start <= limit) {
+      best = i;
+      bestStart = start;
     }
+  }
+
+  return best;
+}
+
+CAMLprim value reonig_scanner_search(value vScanner, value vRegExps,
+                                     value vStr, value vPos,
+                                     value vSameString) {
+  CAMLparam5(vScanner, vRegExps, vStr, vPos, vSameString);
+  CAMLlocal3(ret, tuple, matches);
+
+  scanner_W *scanner = Data_custom_val(vScanner);
+  int best = reonig_scanner_search_internal(scanner, vRegExps, vStr,
+                                            Int_val(vPos),
+                                            Bool_val(vSameString));
+
+  if (best < 0) {
+    CAMLreturn(Val_none);
+  }
+
+  matches = reonig_val_matches(vStr, scanner->regions[best]);
+  tuple = caml_alloc(2, 0);
+  Store_field(tuple, 0, Val_int(best));
+  Store_field(tuple, 1, matches);
+  ret = reonig_val_some(tuple);
+
+  CAMLreturn(ret);
+}
+
+CAMLprim value reonig_scanner_search_regions_native(value vScanner,
+                                                    value vRegExps, value vStr,
+                                                    value vPos,
+                                                    value vSameString,
+                                                    value vRegions) {
+  CAMLparam5(vScanner, vRegExps, vStr, vPos, vSameString);
+  CAMLxparam1(vRegions);
+
+  scanner_W *scanner = Data_custom_val(vScanner);
+  int best = reonig_scanner_search_internal(scanner, vRegExps, vStr,
+                                            Int_val(vPos),
+                                            Bool_val(vSameString));
+
+  if (best < 0) {
+    reonig_clear_regions(vRegions);
   } else {
-    CAMLreturn(Val_int(-1));
+    reonig_write_regions(scanner->regions[best], vRegions);
   }
-};
+
+  CAMLreturn(Val_int(best));
+}
+
+CAMLprim value reonig_scanner_search_regions_bytecode(value *argv, int argn) {
+  return reonig_scanner_search_regions_native(argv[0], argv[1], argv[2],
+                                              argv[3], argv[4], argv[5]);
+}
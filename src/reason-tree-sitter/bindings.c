@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <tree_sitter/api.h>
 
@@ -21,6 +23,11 @@ typedef struct _tree {
   TSTree *tree;
 } tree_W;
 
+typedef struct _query {
+  TSQuery *query;
+  TSQueryCursor *cursor;
+} query_W;
+
 void finalize_parser(value v) {
   parser_W *p;
   p = (parser_W *)Data_custom_val(v);
@@ -51,6 +58,22 @@ static struct custom_operations tree_custom_ops = {
   .deserialize = custom_deserialize_default
 };
 
+void finalize_query(value v) {
+  query_W *p;
+  p = (query_W *)Data_custom_val(v);
+  ts_query_cursor_delete(p->cursor);
+  ts_query_delete(p->query);
+}
+
+static struct custom_operations query_custom_ops = {
+  .identifier = "query handling",
+  .finalize = finalize_query,
+  .compare = custom_compare_default,
+  .hash = custom_hash_default,
+  .serialize = custom_serialize_default,
+  .deserialize = custom_deserialize_default
+};
+
 static struct custom_operations TSNode_custom_ops = {
   .identifier = "TSNode handling",
   .finalize = custom_finalize_default,
@@ -156,6 +179,94 @@ CAMLprim value rets_parser_parse_string(value vParser, value vSource) {
   CAMLreturn(v);
 };
 
+/* Like rets_parser_parse_string, but parses outside of the OCaml runtime
+   lock, so other OCaml threads can run in the meantime. The source is
+   copied, as the GC may move it while we don't hold the lock. The parser
+   must not be used from another thread during the parse. */
+CAMLprim value rets_parser_parse_string_concurrent(value vParser, value vTree,
+                                                   value vSource) {
+  CAMLparam3(vParser, vTree, vSource);
+  CAMLlocal1(v);
+
+  parser_W *p = Data_custom_val(vParser);
+  TSParser *tsparser = p->parser;
+
+  TSTree *oldTree = NULL;
+  // Some(tree)
+  if (Is_block(vTree)) {
+    tree_W *t = Data_custom_val(Field(vTree, 0));
+    oldTree = t->tree;
+  }
+
+  uint32_t len = caml_string_length(vSource);
+  char *source_code = malloc(len + 1);
+  memcpy(source_code, String_val(vSource), len);
+  source_code[len] = 0;
+
+  caml_release_runtime_system();
+  TSTree *tree = ts_parser_parse_string(tsparser, oldTree, source_code, len);
+  caml_acquire_runtime_system();
+
+  free(source_code);
+
+  tree_W treeWrapper;
+  treeWrapper.tree = tree;
+  v = caml_alloc_custom(&tree_custom_ops, sizeof(tree_W), 0, 1);
+  memcpy(Data_custom_val(v), &treeWrapper, sizeof(tree_W));
+
+  CAMLreturn(v);
+};
+
+/* Parses a document given as an OCaml array of lines, without calling back
+   into OCaml. The lines are copied once into a contiguous native buffer -
+   each followed by a newline - which tree-sitter then reads directly, with
+   the runtime lock released. */
+CAMLprim value rets_parser_parse_lines(value vParser, value vTree,
+                                       value vLines) {
+  CAMLparam3(vParser, vTree, vLines);
+  CAMLlocal1(v);
+
+  parser_W *p = Data_custom_val(vParser);
+  TSParser *tsparser = p->parser;
+
+  TSTree *oldTree = NULL;
+  // Some(tree)
+  if (Is_block(vTree)) {
+    tree_W *t = Data_custom_val(Field(vTree, 0));
+    oldTree = t->tree;
+  }
+
+  mlsize_t lineCount = Wosize_val(vLines);
+  size_t len = 0;
+  for (mlsize_t i = 0; i < lineCount; i++) {
+    len += caml_string_length(Field(vLines, i)) + 1;
+  }
+
+  char *source_code = malloc(len + 1);
+  char *pos = source_code;
+  for (mlsize_t i = 0; i < lineCount; i++) {
+    value vLine = Field(vLines, i);
+    size_t lineLength = caml_string_length(vLine);
+    memcpy(pos, String_val(vLine), lineLength);
+    pos[lineLength] = '\n';
+    pos += lineLength + 1;
+  }
+  source_code[len] = 0;
+
+  caml_release_runtime_system();
+  TSTree *tree = ts_parser_parse_string(tsparser, oldTree, source_code, len);
+  caml_acquire_runtime_system();
+
+  free(source_code);
+
+  tree_W treeWrapper;
+  treeWrapper.tree = tree;
+  v = caml_alloc_custom(&tree_custom_ops, sizeof(tree_W), 0, 1);
+  memcpy(Data_custom_val(v), &treeWrapper, sizeof(tree_W));
+
+  CAMLreturn(v);
+};
+
 CAMLprim value rets_tree_root_node(value vTree) {
   CAMLparam1(vTree);
   CAMLlocal1(v);
@@ -221,6 +332,43 @@ CAMLprim value rets_tree_edit_bytecode(value *argv, int argn) {
                                argv[5], argv[6]);
 }
 
+/* Applies an edit to vTree itself, rather than to a copy - so only use this
+   on a tree that isn't shared. Unlike rets_tree_edit, it takes exact
+   columns for the start / old-end / new-end points, so tree-sitter can
+   reuse more of the old tree. */
+CAMLprim value rets_tree_edit_in_place_native(
+    value vTree, value vStartByte, value vOldEndByte, value vNewEndByte,
+    value vStartLine, value vStartColumn, value vOldEndLine,
+    value vOldEndColumn, value vNewEndLine, value vNewEndColumn) {
+  CAMLparam5(vTree, vStartByte, vOldEndByte, vNewEndByte, vStartLine);
+  CAMLxparam5(vStartColumn, vOldEndLine, vOldEndColumn, vNewEndLine,
+              vNewEndColumn);
+
+  tree_W *t = Data_custom_val(vTree);
+
+  TSInputEdit edit;
+  edit.start_byte = Long_val(vStartByte);
+  edit.old_end_byte = Long_val(vOldEndByte);
+  edit.new_end_byte = Long_val(vNewEndByte);
+
+  edit.start_point.row = Long_val(vStartLine);
+  edit.start_point.column = Long_val(vStartColumn);
+  edit.old_end_point.row = Long_val(vOldEndLine);
+  edit.old_end_point.column = Long_val(vOldEndColumn);
+  edit.new_end_point.row = Long_val(vNewEndLine);
+  edit.new_end_point.column = Long_val(vNewEndColumn);
+
+  ts_tree_edit(t->tree, &edit);
+
+  CAMLreturn(Val_unit);
+};
+
+CAMLprim value rets_tree_edit_in_place_bytecode(value *argv, int argn) {
+  return rets_tree_edit_in_place_native(argv[0], argv[1], argv[2], argv[3],
+                                        argv[4], argv[5], argv[6], argv[7],
+                                        argv[8], argv[9]);
+}
+
 CAMLprim value rets_node_string(value vNode) {
   CAMLparam1(vNode);
   CAMLlocal1(v);
@@ -513,3 +661,128 @@ CAMLprim value rets_node_named_child(value vNode, value vX) {
   memcpy(Data_custom_val(v), &child, sizeof(TSNode));
   CAMLreturn(v);
 };
+
+static value rets_val_result_ok(value val) {
+  CAMLparam1(val);
+  CAMLlocal1(result);
+  result = caml_alloc(1, 0);
+  Store_field(result, 0, val);
+  CAMLreturn(result);
+}
+
+static value rets_val_result_error(const char *errorMsg) {
+  CAMLparam0();
+  CAMLlocal2(error, msg);
+  msg = caml_copy_string(errorMsg);
+  error = caml_alloc(1, 1);
+  Store_field(error, 0, msg);
+  CAMLreturn(error);
+}
+
+static value rets_query_new(const TSLanguage *language, value vSource) {
+  CAMLparam1(vSource);
+  CAMLlocal2(ret, v);
+
+  uint32_t errorOffset;
+  TSQueryError errorType;
+  TSQuery *query =
+      ts_query_new(language, String_val(vSource), caml_string_length(vSource),
+                   &errorOffset, &errorType);
+
+  if (query == NULL) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Query error %d at offset %u", errorType,
+             errorOffset);
+    ret = rets_val_result_error(msg);
+  } else {
+    query_W queryWrapper;
+    queryWrapper.query = query;
+    queryWrapper.cursor = ts_query_cursor_new();
+    v = caml_alloc_custom(&query_custom_ops, sizeof(query_W), 0, 1);
+    memcpy(Data_custom_val(v), &queryWrapper, sizeof(query_W));
+    ret = rets_val_result_ok(v);
+  }
+
+  CAMLreturn(ret);
+}
+
+CAMLprim value rets_query_new_json(value vSource) {
+  return rets_query_new(tree_sitter_json(), vSource);
+}
+
+CAMLprim value rets_query_new_c(value vSource) {
+  return rets_query_new(tree_sitter_c(), vSource);
+}
+
+CAMLprim value rets_query_capture_names(value vQuery) {
+  CAMLparam1(vQuery);
+  CAMLlocal2(ret, name);
+
+  query_W *q = Data_custom_val(vQuery);
+  // Allocation below may move the custom block, so hold on to the query
+  TSQuery *query = q->query;
+  uint32_t count = ts_query_capture_count(query);
+
+  if (count == 0) {
+    CAMLreturn(Atom(0));
+  }
+
+  ret = caml_alloc(count, 0);
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t length;
+    const char *str = ts_query_capture_name_for_id(query, i, &length);
+    name = caml_alloc_initialized_string(length, str);
+    Store_field(ret, i, name);
+  }
+
+  CAMLreturn(ret);
+}
+
+/* Runs the query over rows [startRow, endRow) of the tree, and returns every
+   capture in one packed int32 bigarray - 5 entries per capture:
+   [| captureId, startRow, startColumn, endRow, endColumn, ... |]
+   in the order the captures appear in the document. */
+CAMLprim value rets_query_captures(value vQuery, value vTree, value vStartRow,
+                                   value vEndRow) {
+  CAMLparam4(vQuery, vTree, vStartRow, vEndRow);
+  CAMLlocal1(ret);
+
+  query_W *q = Data_custom_val(vQuery);
+  tree_W *t = Data_custom_val(vTree);
+
+  TSPoint start = {.row = Int_val(vStartRow), .column = 0};
+  TSPoint end = {.row = Int_val(vEndRow), .column = 0};
+  ts_query_cursor_set_point_range(q->cursor, start, end);
+  ts_query_cursor_exec(q->cursor, q->query, ts_tree_root_node(t->tree));
+
+  size_t capacity = 256;
+  size_t count = 0;
+  int32_t *data = malloc(capacity * 5 * sizeof(int32_t));
+
+  TSQueryMatch match;
+  uint32_t captureIndex;
+  while (ts_query_cursor_next_capture(q->cursor, &match, &captureIndex)) {
+    TSQueryCapture capture = match.captures[captureIndex];
+
+    if (count == capacity) {
+      capacity *= 2;
+      data = realloc(data, capacity * 5 * sizeof(int32_t));
+    }
+
+    TSPoint captureStart = ts_node_start_point(capture.node);
+    TSPoint captureEnd = ts_node_end_point(capture.node);
+    int32_t *entry = data + count * 5;
+    entry[0] = capture.index;
+    entry[1] = captureStart.row;
+    entry[2] = captureStart.column;
+    entry[3] = captureEnd.row;
+    entry[4] = captureEnd.column;
+    count++;
+  }
+
+  // Hand the buffer over to the bigarray, so it is freed along with it
+  ret = caml_ba_alloc_dims(CAML_BA_INT32 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED,
+                           1, data, (intnat)(count * 5));
+
+  CAMLreturn(ret);
+}
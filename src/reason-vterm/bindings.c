@@ -11,7 +11,7 @@
 
 #include <vterm.h>
 
-static value reason_libvterm_Val_color(const VTermColor *pColor) {
+static int reason_libvterm_pack_color(const VTermColor *pColor) {
 
   // Colors are packed as follows:
   // [ 8-bit red] [8-bit green] [8-bit blue / index] [2 control bits] (least
@@ -35,33 +35,38 @@ static value reason_libvterm_Val_color(const VTermColor *pColor) {
     colorVal = 3 + (pColor->indexed.idx << 2);
   }
 
-  return Val_int(colorVal);
+  return colorVal;
+}
+
+// Packs a cell as [| char, fg, bg, style |] - the same layout used by
+// [reason_libvterm_Val_screencell], but without allocating.
+static void reason_libvterm_pack_screencell(const VTermScreenCell *pScreenCell,
+                                            int32_t *pOut) {
+  int isReverse = pScreenCell->attrs.reverse;
+
+  int originalForeground = reason_libvterm_pack_color(&pScreenCell->fg);
+  int originalBackground = reason_libvterm_pack_color(&pScreenCell->bg);
+
+  pOut[0] = pScreenCell->chars[0];
+  pOut[1] = isReverse ? originalBackground : originalForeground;
+  pOut[2] = isReverse ? originalForeground : originalBackground;
+  pOut[3] = 0 + (pScreenCell->attrs.bold ? 1 : 0) +
+            (pScreenCell->attrs.italic ? 2 : 0) +
+            (pScreenCell->attrs.underline ? 4 : 0);
 }
 
 static value reason_libvterm_Val_screencell(const VTermScreenCell *pScreenCell) {
   CAMLparam0();
   CAMLlocal1(ret);
 
-  uint32_t c = pScreenCell->chars[0];
+  int32_t packed[4];
+  reason_libvterm_pack_screencell(pScreenCell, packed);
 
   ret = caml_alloc(4, 0);
-  Store_field(ret, 0, Val_int(c));
-
-  int isReverse = pScreenCell->attrs.reverse;
-
-  value originalForeground = reason_libvterm_Val_color(&pScreenCell->fg);
-  value originalBackground = reason_libvterm_Val_color(&pScreenCell->bg);
-
-  value fg = isReverse ? originalBackground : originalForeground;
-  value bg = isReverse ? originalForeground : originalBackground;
-
-  Store_field(ret, 1, fg);
-  Store_field(ret, 2, bg);
-  int style = 0 + (pScreenCell->attrs.bold ? 1 : 0) +
-              (pScreenCell->attrs.italic ? 2 : 0) +
-              (pScreenCell->attrs.underline ? 4 : 0);
-
-  Store_field(ret, 3, Val_int(style));
+  Store_field(ret, 0, Val_int(packed[0]));
+  Store_field(ret, 1, Val_int(packed[1]));
+  Store_field(ret, 2, Val_int(packed[2]));
+  Store_field(ret, 3, Val_int(packed[3]));
   CAMLreturn(ret);
 }
 
@@ -269,7 +274,7 @@ int reason_libvterm_onScreenResizeF(int rows, int cols, void *user) {
   CAMLreturn(0);
 }
 
-int reason_libvterm_onScreenDamageF(VTermRect rect, void *user) {
+static void reason_libvterm_dispatchDamage(VTermRect rect, void *user) {
   CAMLparam0();
   CAMLlocal1(outRect);
 
@@ -286,7 +291,46 @@ int reason_libvterm_onScreenDamageF(VTermRect rect, void *user) {
   }
 
   caml_callback2(*reason_libvterm_onScreenDamage, Val_int(user), outRect);
-  CAMLreturn(0);
+  CAMLreturn0;
+}
+
+// While an input write is in progress, damage is merged here instead of
+// being sent to OCaml per-callback - the union is dispatched once the
+// write returns.
+typedef struct {
+  int hasDamage;
+  VTermRect rect;
+  void *user;
+} reason_libvterm_damage;
+
+static reason_libvterm_damage *reason_libvterm_pendingDamage = NULL;
+
+int reason_libvterm_onScreenDamageF(VTermRect rect, void *user) {
+  reason_libvterm_damage *pDamage = reason_libvterm_pendingDamage;
+
+  if (pDamage == NULL) {
+    reason_libvterm_dispatchDamage(rect, user);
+  } else if (!pDamage->hasDamage) {
+    pDamage->hasDamage = 1;
+    pDamage->rect = rect;
+    pDamage->user = user;
+  } else {
+    VTermRect *pRect = &pDamage->rect;
+    if (rect.start_row < pRect->start_row) {
+      pRect->start_row = rect.start_row;
+    }
+    if (rect.end_row > pRect->end_row) {
+      pRect->end_row = rect.end_row;
+    }
+    if (rect.start_col < pRect->start_col) {
+      pRect->start_col = rect.start_col;
+    }
+    if (rect.end_col > pRect->end_col) {
+      pRect->end_col = rect.end_col;
+    }
+  }
+
+  return 1;
 }
 
 int VTermMod_val(value vMod) {
@@ -355,6 +399,9 @@ CAMLprim value reason_libvterm_vterm_screen_enable_altscreen(value vTerm,
   VTermScreen *pScreen = vterm_obtain_screen(pTerm);
 
   vterm_screen_enable_altscreen(pScreen, altScreenEnabled);
+  // Damage is merged at screen granularity, so it's held by libvterm until
+  // flushed - deliver it now rather than with the next write.
+  vterm_screen_flush_damage(pScreen);
 
   CAMLreturn(Val_unit);
 }
@@ -381,6 +428,50 @@ CAMLprim value reason_libvterm_vterm_screen_get_cell(value vTerm, value vRow,
   CAMLreturn(ret);
 }
 
+CAMLprim value reason_libvterm_vterm_screen_get_cells(value vTerm,
+                                                      value vRect,
+                                                      value vColumns,
+                                                      value vCells) {
+  CAMLparam4(vTerm, vRect, vColumns, vCells);
+
+  VTerm *pTerm = (VTerm *)vTerm;
+  VTermScreen *pScreen = vterm_obtain_screen(pTerm);
+
+  int startRow = Int_val(Field(vRect, 0));
+  int endRow = Int_val(Field(vRect, 1));
+  int startCol = Int_val(Field(vRect, 2));
+  int endCol = Int_val(Field(vRect, 3));
+  int columns = Int_val(vColumns);
+
+  int32_t *pCells = (int32_t *)Caml_ba_data_val(vCells);
+  intnat count = Caml_ba_array_val(vCells)->dim[0] / 4;
+
+  if (startCol < 0) {
+    startCol = 0;
+  }
+  if (endCol > columns) {
+    endCol = columns;
+  }
+
+  VTermPos pos;
+  VTermScreenCell cell;
+  for (int row = startRow < 0 ? 0 : startRow; row < endRow; row++) {
+    if ((intnat)row * columns + endCol > count) {
+      break;
+    }
+
+    pos.row = row;
+    for (int col = startCol; col < endCol; col++) {
+      pos.col = col;
+      vterm_screen_get_cell(pScreen, pos, &cell);
+      reason_libvterm_pack_screencell(&cell,
+                                      &pCells[(row * columns + col) * 4]);
+    }
+  }
+
+  CAMLreturn(Val_unit);
+}
+
 CAMLprim value reason_libvterm_vterm_keyboard_unichar(value vTerm, value vChar,
                                                       value vMod) {
   CAMLparam3(vTerm, vChar, vMod);
@@ -430,6 +521,9 @@ CAMLprim value reason_libvterm_vterm_new(value vId, value vRows, value vCol) {
   vterm_output_set_callback(pTerm, &reason_libvterm_onOutputF, id);
   VTermScreen *pScreen = vterm_obtain_screen(pTerm);
   vterm_screen_set_callbacks(pScreen, &reason_libvterm_screen_callbacks, id);
+  // Let libvterm merge damage across a write - it is flushed in
+  // [reason_libvterm_vterm_input_write].
+  vterm_screen_set_damage_merge(pScreen, VTERM_DAMAGE_SCREEN);
   vterm_screen_reset(pScreen, 1);
   CAMLreturn((value)pTerm);
 }
@@ -476,15 +570,65 @@ CAMLprim value reason_libvterm_vterm_set_size(value vTerm, value vSize) {
   int rows = Int_val(Field(vSize, 0));
   int cols = Int_val(Field(vSize, 1));
   vterm_set_size(pTerm, rows, cols);
+  // As above, flush the damage from the resize instead of holding it until
+  // the next write
+  vterm_screen_flush_damage(vterm_obtain_screen(pTerm));
   CAMLreturn(Val_unit);
 }
 
+static int reason_libvterm_input_write_internal(VTerm *pTerm,
+                                               const char *bytes, size_t len) {
+  // Save the outer accumulator, in case a callback re-enters a write
+  reason_libvterm_damage damage = {0};
+  reason_libvterm_damage *pOuterDamage = reason_libvterm_pendingDamage;
+  reason_libvterm_pendingDamage = &damage;
+
+  int ret = vterm_input_write(pTerm, bytes, len);
+  vterm_screen_flush_damage(vterm_obtain_screen(pTerm));
+
+  reason_libvterm_pendingDamage = pOuterDamage;
+
+  if (damage.hasDamage) {
+    reason_libvterm_dispatchDamage(damage.rect, damage.user);
+  }
+
+  return ret;
+}
+
+// Used for both strings and bytes. libvterm calls back into OCaml while
+// processing input, and the GC may move the block - so it is copied out
+// first. The copy is length-based, so embedded NULs are preserved.
 CAMLprim value reason_libvterm_vterm_input_write(value vTerm, value vStr) {
   CAMLparam2(vTerm, vStr);
   VTerm *pTerm = (VTerm *)vTerm;
-  int len = caml_string_length(vStr);
-  char *bytes = caml_stat_strdup(String_val(vStr));
-  int ret = vterm_input_write(pTerm, bytes, len);
+  size_t len = caml_string_length(vStr);
+  char *bytes = (char *)malloc(len > 0 ? len : 1);
+  memcpy(bytes, String_val(vStr), len);
+
+  int ret = reason_libvterm_input_write_internal(pTerm, bytes, len);
   free(bytes);
+
+  CAMLreturn(Val_int(ret));
+}
+
+// Bigarray data lives outside of the OCaml heap and does not move, so it
+// can be handed to libvterm directly.
+CAMLprim value reason_libvterm_vterm_input_write_bigarray(value vTerm,
+                                                         value vBuffer,
+                                                         value vOffset,
+                                                         value vLength) {
+  CAMLparam4(vTerm, vBuffer, vOffset, vLength);
+  VTerm *pTerm = (VTerm *)vTerm;
+  intnat size = Caml_ba_array_val(vBuffer)->dim[0];
+  intnat offset = Int_val(vOffset);
+  intnat length = Int_val(vLength);
+
+  if (offset < 0 || length < 0 || offset + length > size) {
+    caml_invalid_argument("Vterm.writeBuffer");
+  }
+
+  const char *bytes = (const char *)Caml_ba_data_val(vBuffer) + offset;
+  int ret = reason_libvterm_input_write_internal(pTerm, bytes, length);
+
   CAMLreturn(Val_int(ret));
 }